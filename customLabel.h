@@ -30,8 +30,11 @@
 #include <QJsonArray>
 #include <QJsonValue>
 #include <QDebug>
+#include <QTimer>
 
-QMap<int, bool> keyStates;
+#include "frameCapture.h"
+#include "input.h"
+#include "particles.h"
 
 #define TILES_X 32
 #define TILES_Y 18
@@ -158,7 +161,7 @@ struct SignalList{
                 return list.at(i);
         Sign s;
         s.ID=ID;
-        s.state=new bool;
+        s.state=new bool(false);
         list.push_back(s);
         return list.at(list.size()-1);
     }
@@ -332,6 +335,32 @@ struct World{
 
 
 
+    void update(QRectF box){
+        for(int i=0;i<tiles.size();i++){
+            tiles.at(i).update(box);
+        }
+        for(int i=0;i<buttons.size();i++){
+            buttons.at(i).update(box);
+        }
+        for(int i=0;i<doors.size();i++){
+            doors.at(i).update(box);
+        }
+    }
+
+    std::vector<QRectF> solidBoxes(){
+        std::vector<QRectF> boxes;
+        for(int i=0;i<tiles.size();i++)
+            if(tiles.at(i).solid)
+                boxes.push_back(tiles.at(i).box);
+        for(int i=0;i<doors.size();i++)
+            if(doors.at(i).solid)
+                boxes.push_back(doors.at(i).box);
+        for(int i=0;i<buttons.size();i++)
+            if(buttons.at(i).solid)
+                boxes.push_back(buttons.at(i).box);
+        return boxes;
+    }
+
     void print(QPainter &painter, QRectF mapRect){
         QTransform tr;
         tr.rotate(90);
@@ -381,6 +410,9 @@ struct Player{
     float vx;
     float vy;
 
+    bool landed=false;
+    float landingSpeed=0;
+
     QRectF outBox(){
         return QRectF(x, y, 1.0, 1.0);
     }
@@ -403,15 +435,15 @@ struct Player{
         return QRectF(x, y, TILES_X, TILES_Y);
     }
 
-    void tick(World &world){
+    void tick(World &world, const Input &input){
 
-        if(vx>-0.35 && keyStates[Qt::Key_Left])
+        if(vx>-0.35 && input.down(ActionLeft))
             vx-=0.01;
-        if(vx<0.35 && keyStates[Qt::Key_Right])
+        if(vx<0.35 && input.down(ActionRight))
             vx+=0.01;
         vx=vx*0.9;
 
-        if(keyStates[Qt::Key_Up]){
+        if(input.down(ActionJump)){
             for(int i=0;i<world.tiles.size();i++)
                 if(world.tiles.at(i).box.intersects(underBox())&&vy>=0)
                     vy=-0.18;
@@ -423,20 +455,18 @@ struct Player{
         checkBoxV(world);
 
         y+=vy;
-        if(checkBoxV(world))
+        landed=false;
+        if(checkBoxV(world)){
+            if(vy>0.05){
+                landed=true;
+                landingSpeed=vy;
+            }
             vy=0;
+        }
         x+=vx;
         checkBoxH(world);
 
-        for(int i=0;i<world.tiles.size();i++){
-            world.tiles.at(i).update(box());
-        }
-        for(int i=0;i<world.buttons.size();i++){
-            world.buttons.at(i).update(box());
-        }
-        for(int i=0;i<world.doors.size();i++){
-            world.doors.at(i).update(box());
-        }
+        world.update(box());
 
     }
 
@@ -523,13 +553,27 @@ public:
 
     Player player;
     World world=World("map.bmp", "button.bmp", "door.bmp");
+    FrameCapture capture;
+    Input input;
+    ParticleSystem particles;
+    bool showStats=false;
+    int gridStale=0;
 
 
     CustomLabel(){
         player.x=8;
         player.y=8;
-        for(int i=0;i<1000;i++)
-            keyStates[i]=false;
+
+        // Apply the initial signal states before the grid is built
+        world.update(QRectF());
+
+        for(int i=0;i<world.buttons.size();i++)
+            if(world.buttons.at(i).statePressed!=nullptr)
+                particles.watch(world.buttons.at(i).statePressed, world.buttons.at(i).box, ParticleSpark);
+        for(int i=0;i<world.doors.size();i++)
+            if(world.doors.at(i).stateSolid!=nullptr)
+                particles.watch(world.doors.at(i).stateSolid, world.doors.at(i).box, ParticleDoor);
+        particles.grid.build(world.solidBoxes());
     }
 
 private:
@@ -550,21 +594,68 @@ protected:
 
         if(cTime-lastTime>4){
             lastTime=cTime;
-            player.tick(world);
+            input.consume(std::chrono::steady_clock::now());
+            player.tick(world, input);
+
+            if(player.landed)
+                particles.burst(QRectF(player.x+0.1, player.y+0.9, 0.8, 0.1), ParticleDust, (int)(player.landingSpeed*1500), 0.04f, -0.03f);
+            // Tiles are updated before buttons, so a signal flipped this tick
+            // only reaches them next tick; rebuild the grid on both
+            if(particles.poll())
+                gridStale=2;
+            if(gridStale>0){
+                particles.grid.build(world.solidBoxes());
+                gridStale--;
+            }
+            particles.tick();
         }
 
 
-        // Set pen
+        // While capturing, paint into a pooled buffer and blit it
         QPainter painter(this);
+        auto captureStart=std::chrono::steady_clock::now();
+        QImage* frame=capture.acquire(size()*devicePixelRatioF(), devicePixelRatioF());
+        if(frame!=nullptr){
+            auto acquired=std::chrono::steady_clock::now();
+            QPainter framePainter(frame);
+            paintScene(framePainter);
+            framePainter.end();
+
+            auto blitStart=std::chrono::steady_clock::now();
+            painter.drawImage(0, 0, *frame);
+            capture.submit(frame);
+            auto submitted=std::chrono::steady_clock::now();
+            capture.measured(std::chrono::duration<double, std::milli>((acquired-captureStart)+(submitted-blitStart)).count());
+        }
+        else{
+            paintScene(painter);
+        }
+
+        if(showStats)
+            drawStats(painter);
+        painter.end();
+
+        // The backing store is flushed after paintEvent returns; a zero timer
+        // runs once that update has been delivered
+        if(input.paint())
+            QTimer::singleShot(0, this, [this]{ input.presented(); });
+
+
+        update();
+    }
+
+    void paintScene(QPainter &painter){
+        // Set pen
         QPen pen(Qt::black, 2);
         painter.setPen(pen);
 
         // Paint the base
-        painter.fillRect(rect().left(), rect().top(), rect().right(), rect().bottom(), QColor(0x0c,0x29,0x2a));
+        painter.fillRect(rect(), QColor(0x0c,0x29,0x2a));
         //painter.drawRect(rect().left(), rect().top(), rect().right(), rect().bottom());
 
 
         world.print(painter, player.mapRect());
+        particles.render(painter, size(), QPointF(TILES_X/2-player.mapRect().x(), TILES_Y/2-player.mapRect().y()), RATIO_H, RATIO_V);
 
 
         QImage imagePlayer;
@@ -573,9 +664,30 @@ protected:
         else
             imagePlayer.load("playerL.png");
         painter.drawImage(scale(QRectF(TILES_X/2, TILES_Y/2, player.outBox().width(), player.outBox().height())), imagePlayer);
+    }
 
+    void drawStats(QPainter &painter){
+        QString text=QString("input latency %1 ms (avg %2, max %3)")
+                         .arg(input.latencyLast, 0, 'f', 1)
+                         .arg(input.latencyAverage, 0, 'f', 1)
+                         .arg(input.latencyMax, 0, 'f', 1);
+        text+=QString("\nparticles %1").arg(particles.pool.count);
+        if(capture.active)
+            text+=QString("\nrecording %1 written, %2 dropped, cost %3 ms (avg %4, max %5)")
+                      .arg(capture.written.load()).arg(capture.dropped.load())
+                      .arg(capture.costLast, 0, 'f', 2)
+                      .arg(capture.costAverage, 0, 'f', 2)
+                      .arg(capture.costMax, 0, 'f', 2);
+
+        painter.setPen(Qt::white);
+        painter.drawText(rect().adjusted(6, 4, -6, -4), Qt::AlignLeft | Qt::AlignTop, text);
+    }
 
-        update();
+    void toggleCapture(CaptureMode mode){
+        if(capture.active)
+            capture.stop();
+        else
+            capture.start(size()*devicePixelRatioF(), devicePixelRatioF(), mode);
     }
 
     void mousePressEvent(QMouseEvent* event) override {
@@ -613,22 +725,18 @@ protected:
 
     void keyPressEvent(QKeyEvent *event) override {
         //event->text().at(0).unicode()
-        if(event->key()==Qt::Key_Left)
-            keyStates[Qt::Key_Left]=true;
-        if(event->key()==Qt::Key_Right)
-            keyStates[Qt::Key_Right]=true;
-        if(event->key()==Qt::Key_Up)
-            keyStates[Qt::Key_Up]=true;
+        input.push(event, true);
+        if(event->key()==Qt::Key_F3 && !event->isAutoRepeat())
+            showStats=!showStats;
+        if(event->key()==Qt::Key_F9 && !event->isAutoRepeat())
+            toggleCapture(CaptureMode::Png);
+        if(event->key()==Qt::Key_F10 && !event->isAutoRepeat())
+            toggleCapture(CaptureMode::Raw);
     }
 
     void keyReleaseEvent(QKeyEvent *event) override {
         //event->text().at(0).unicode()
-        if(event->key()==Qt::Key_Left)
-            keyStates[Qt::Key_Left]=false;
-        if(event->key()==Qt::Key_Right)
-            keyStates[Qt::Key_Right]=false;
-        if(event->key()==Qt::Key_Up)
-            keyStates[Qt::Key_Up]=false;
+        input.push(event, false);
     }
 
 
@@ -0,0 +1,255 @@
+#ifndef FRAMECAPTURE_H
+#define FRAMECAPTURE_H
+
+#include <vector>
+#include <deque>
+
+//Input Output
+#include <iostream>
+
+//Time for frame stamps
+#include <chrono>
+
+//Threads
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+//QT
+#include <QImage>
+#include <QSize>
+#include <QDir>
+#include <QFile>
+#include <QString>
+#include <QDateTime>
+
+#define CAPTURE_BUFFERS 8
+#define CAPTURE_DIR "capture"
+
+enum class CaptureMode{
+    Png,
+    Raw
+};
+
+//Records the frames painted by CustomLabel without stalling the GUI thread.
+//The GUI thread paints straight into one of a fixed pool of QImages and hands
+//it over; a worker thread writes it to disk and gives the buffer back. When
+//no buffer is free the frame is dropped instead of waiting for the writer.
+struct FrameCapture{
+
+    struct Frame{
+        QImage image;
+        long long frame=0;
+        long long timeMs=0;
+    };
+
+    std::vector<Frame> pool;
+    std::vector<int> freeList;
+    std::deque<int> ready;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread worker;
+
+    CaptureMode mode=CaptureMode::Png;
+    QString directory;
+    QSize size;
+    qreal ratio=1.0;
+    bool active=false;
+    bool stopping=false;
+
+    std::chrono::steady_clock::time_point startTime;
+    long long frameCount=0;
+    std::atomic<long long> written{0};
+    std::atomic<long long> dropped{0};
+
+    //Render thread cost of acquire + blit + submit in ms
+    double costLast=0;
+    double costAverage=0;
+    double costMax=0;
+    long long costSamples=0;
+
+    ~FrameCapture(){
+        stop();
+    }
+
+    //frameSize is in device pixels, pixelRatio is the widget's devicePixelRatioF()
+    bool start(QSize frameSize, qreal pixelRatio, CaptureMode captureMode){
+        if(active || frameSize.isEmpty())
+            return false;
+
+        //Never reuse the directory of a previous take
+        QString base=QString(CAPTURE_DIR)+"/"+QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss-zzz");
+        directory=base;
+        for(int i=1;QDir(directory).exists();i++)
+            directory=base+QString("-%1").arg(i);
+        if(!QDir().mkpath(directory)){
+            std::cout<<"capture: cannot create "<<directory.toStdString()<<std::endl;
+            return false;
+        }
+
+        mode=captureMode;
+        pool.clear();
+        pool.resize(CAPTURE_BUFFERS);
+        freeList.clear();
+        ready.clear();
+        for(int i=0;i<CAPTURE_BUFFERS;i++)
+            freeList.push_back(i);
+        allocate(frameSize, pixelRatio);
+
+        stopping=false;
+        frameCount=0;
+        written=0;
+        dropped=0;
+        costLast=0;
+        costAverage=0;
+        costMax=0;
+        costSamples=0;
+        startTime=std::chrono::steady_clock::now();
+        worker=std::thread(&FrameCapture::run, this);
+        active=true;
+
+        std::cout<<"capture: recording to "<<directory.toStdString()<<std::endl;
+        return true;
+    }
+
+    void stop(){
+        if(!active)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping=true;
+        }
+        cond.notify_one();
+        worker.join();
+        active=false;
+        pool.clear();
+
+        std::cout<<"capture: "<<written.load()<<" frames written, "<<dropped.load()<<" dropped, "
+                 <<"render thread cost avg "<<costAverage<<" ms, max "<<costMax<<" ms"<<std::endl;
+    }
+
+    //Returns a free buffer to paint the next frame into, or nullptr when the
+    //frame has to be dropped. Never blocks on the writer. After a resize the
+    //pool is reallocated as soon as the writer has handed every buffer back.
+    QImage* acquire(QSize frameSize, qreal pixelRatio){
+        if(!active)
+            return nullptr;
+        frameCount++;
+
+        int index;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(frameSize!=size || pixelRatio!=ratio){
+                if(freeList.size()!=pool.size()){
+                    dropped++;
+                    return nullptr;
+                }
+                allocate(frameSize, pixelRatio);
+                std::cout<<"capture: frame size changed to "<<size.width()<<"x"<<size.height()<<std::endl;
+            }
+            if(freeList.empty()){
+                dropped++;
+                return nullptr;
+            }
+            index=freeList.back();
+            freeList.pop_back();
+        }
+
+        Frame &frame=pool.at(index);
+        frame.frame=frameCount-1;
+        frame.timeMs=std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-startTime).count();
+        return &frame.image;
+    }
+
+    //Queues a buffer obtained from acquire() for the writer thread.
+    void submit(QImage* image){
+        int index=indexOf(image);
+        if(index<0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(index);
+        }
+        cond.notify_one();
+    }
+
+    void measured(double ms){
+        costLast=ms;
+        costSamples++;
+        costAverage+=(costLast-costAverage)/(costSamples<100 ? costSamples : 100);
+        if(costLast>costMax)
+            costMax=costLast;
+    }
+
+private:
+
+    //Only called while the writer holds no buffer
+    void allocate(QSize frameSize, qreal pixelRatio){
+        size=frameSize;
+        ratio=pixelRatio;
+        for(int i=0;i<pool.size();i++){
+            QImage &image=pool.at(i).image;
+            image=QImage(size, QImage::Format_ARGB32_Premultiplied);
+            image.setDevicePixelRatio(ratio);
+            image.fill(0);
+        }
+    }
+
+    int indexOf(QImage* image){
+        for(int i=0;i<pool.size();i++)
+            if(&pool.at(i).image==image)
+                return i;
+        return -1;
+    }
+
+    void run(){
+        QFile rawFile(directory+"/frames.raw");
+        QFile indexFile(directory+"/index.txt");
+        if(mode==CaptureMode::Raw){
+            rawFile.open(QIODevice::WriteOnly);
+            indexFile.open(QIODevice::WriteOnly | QIODevice::Text);
+            indexFile.write("#frame timeMs offset width height bytesPerLine format\n");
+        }
+
+        while(true){
+            int index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this]{ return stopping || !ready.empty(); });
+                if(ready.empty())
+                    break;
+                index=ready.front();
+                ready.pop_front();
+            }
+
+            Frame &frame=pool.at(index);
+            bool ok;
+            if(mode==CaptureMode::Png){
+                ok=frame.image.save(directory+QString("/frame%1.png").arg(frame.frame, 6, 10, QChar('0')), "PNG");
+            }
+            else{
+                const QImage &image=frame.image;
+                qint64 offset=rawFile.pos();
+                ok=rawFile.write((const char*)image.constBits(), image.sizeInBytes())==image.sizeInBytes();
+                indexFile.write(QString("%1 %2 %3 %4 %5 %6 %7\n")
+                                    .arg(frame.frame).arg(frame.timeMs).arg(offset)
+                                    .arg(image.width()).arg(image.height())
+                                    .arg(image.bytesPerLine()).arg((int)image.format())
+                                    .toUtf8());
+            }
+            if(ok)
+                written++;
+            else
+                dropped++;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            freeList.push_back(index);
+        }
+
+        rawFile.close();
+        indexFile.close();
+    }
+};
+
+#endif // FRAMECAPTURE_H
@@ -0,0 +1,140 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <array>
+#include <bitset>
+
+//Time for event stamps and latency
+#include <chrono>
+
+//QT
+#include <QKeyEvent>
+
+#define INPUT_QUEUE 64
+
+enum Action{
+    ActionLeft,
+    ActionRight,
+    ActionJump,
+    ActionCount
+};
+
+struct InputEvent{
+    Action action;
+    bool pressed;
+    std::chrono::steady_clock::time_point time;
+};
+
+//Keeps the key events received between two simulation ticks. Each tick
+//consumes every event that arrived before it, so a press and release that
+//both land between ticks is still seen by that tick.
+struct Input{
+    std::array<InputEvent, INPUT_QUEUE> queue;
+    int head=0;
+    int count=0;
+
+    std::bitset<ActionCount> held;
+    std::bitset<ActionCount> tapped;
+    //Presses applied since the last tick, including ones folded in on overflow
+    std::bitset<ActionCount> taps;
+
+    //Oldest event consumed since the last painted frame
+    bool pending=false;
+    std::chrono::steady_clock::time_point pendingTime;
+
+    //Oldest event of the painted frame waiting for its flush
+    bool painted=false;
+    std::chrono::steady_clock::time_point paintedTime;
+
+    //Input-to-present latency in ms, taken after the backing store flush
+    double latencyLast=0;
+    double latencyAverage=0;
+    double latencyMax=0;
+    long long latencySamples=0;
+
+    static bool action(int key, Action &out){
+        if(key==Qt::Key_Left)
+            out=ActionLeft;
+        else if(key==Qt::Key_Right)
+            out=ActionRight;
+        else if(key==Qt::Key_Up)
+            out=ActionJump;
+        else
+            return false;
+        return true;
+    }
+
+    void push(QKeyEvent *event, bool pressed){
+        Action a;
+        if(event->isAutoRepeat() || !action(event->key(), a))
+            return;
+
+        //Full queue: fold the oldest event into the state instead of losing it
+        if(count==INPUT_QUEUE){
+            apply(queue.at(head));
+            head=(head+1)%INPUT_QUEUE;
+            count--;
+        }
+
+        InputEvent &e=queue.at((head+count)%INPUT_QUEUE);
+        e.action=a;
+        e.pressed=pressed;
+        e.time=std::chrono::steady_clock::now();
+        count++;
+    }
+
+    //Called at the start of a simulation tick
+    void consume(std::chrono::steady_clock::time_point tickTime){
+        while(count>0 && queue.at(head).time<=tickTime){
+            apply(queue.at(head));
+            head=(head+1)%INPUT_QUEUE;
+            count--;
+        }
+        tapped=taps;
+        taps.reset();
+    }
+
+    bool down(Action a) const{
+        return held.test(a) || tapped.test(a);
+    }
+
+    //Called at the end of paintEvent; returns true if the frame carries
+    //input that still has to be timed by presented()
+    bool paint(){
+        if(!pending)
+            return false;
+        pending=false;
+        if(!painted || pendingTime<paintedTime)
+            paintedTime=pendingTime;
+        painted=true;
+        return true;
+    }
+
+    //Called once the painted frame has been flushed to the window
+    void presented(){
+        if(!painted)
+            return;
+        painted=false;
+
+        auto now=std::chrono::steady_clock::now();
+        latencyLast=std::chrono::duration<double, std::milli>(now-paintedTime).count();
+        latencySamples++;
+        latencyAverage+=(latencyLast-latencyAverage)/(latencySamples<100 ? latencySamples : 100);
+        if(latencyLast>latencyMax)
+            latencyMax=latencyLast;
+    }
+
+private:
+
+    void apply(const InputEvent &e){
+        held.set(e.action, e.pressed);
+        if(e.pressed)
+            taps.set(e.action);
+        if(!pending || e.time<pendingTime){
+            pending=true;
+            pendingTime=e.time;
+        }
+    }
+};
+
+#endif // INPUT_H
@@ -0,0 +1,342 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <vector>
+#include <cmath>
+#include <cstring>
+
+//SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#include <emmintrin.h>
+#define PARTICLES_SSE2
+#endif
+
+//QT
+#include <QPainter>
+#include <QImage>
+#include <QColor>
+#include <QRectF>
+#include <QPointF>
+
+#define PARTICLE_MAX 32768
+#define PARTICLE_GRAVITY 0.004f
+#define PARTICLE_BOUNCE 0.35f
+#define PARTICLE_SPRITE 4
+
+enum ParticleKind{
+    ParticleDust,
+    ParticleSpark,
+    ParticleDoor,
+    ParticleKindCount
+};
+
+//Fixed capacity structure-of-arrays storage. Nothing is allocated per
+//particle; dead particles are replaced by the last live one.
+struct ParticlePool{
+    alignas(16) float x[PARTICLE_MAX];
+    alignas(16) float y[PARTICLE_MAX];
+    alignas(16) float vx[PARTICLE_MAX];
+    alignas(16) float vy[PARTICLE_MAX];
+    alignas(16) float life[PARTICLE_MAX];
+    unsigned char kind[PARTICLE_MAX];
+    int count=0;
+
+    ParticlePool(){
+        std::memset(x, 0, sizeof(x));
+        std::memset(y, 0, sizeof(y));
+        std::memset(vx, 0, sizeof(vx));
+        std::memset(vy, 0, sizeof(vy));
+        std::memset(life, 0, sizeof(life));
+        std::memset(kind, 0, sizeof(kind));
+    }
+
+    bool add(float px, float py, float pvx, float pvy, float plife, ParticleKind pkind){
+        if(count==PARTICLE_MAX)
+            return false;
+        x[count]=px;
+        y[count]=py;
+        vx[count]=pvx;
+        vy[count]=pvy;
+        life[count]=plife;
+        kind[count]=pkind;
+        count++;
+        return true;
+    }
+
+    void compact(){
+        int i=0;
+        while(i<count){
+            if(life[i]>0){
+                i++;
+                continue;
+            }
+            count--;
+            x[i]=x[count];
+            y[i]=y[count];
+            vx[i]=vx[count];
+            vy[i]=vy[count];
+            life[i]=life[count];
+            kind[i]=kind[count];
+        }
+
+        //The SIMD loop runs in groups of four; reset the lanes past count
+        for(int i=count;i<((count+3)&~3);i++){
+            x[i]=0;
+            y[i]=0;
+            vx[i]=0;
+            vy[i]=0;
+            life[i]=0;
+        }
+    }
+};
+
+//Solid cells of the world, one byte per tile
+struct ParticleGrid{
+    std::vector<unsigned char> cells;
+    int left=0;
+    int top=0;
+    int width=0;
+    int height=0;
+
+    void build(const std::vector<QRectF> &boxes){
+        cells.clear();
+        width=0;
+        height=0;
+        if(boxes.empty())
+            return;
+
+        QRectF bounds=boxes.at(0);
+        for(int i=1;i<boxes.size();i++)
+            bounds|=boxes.at(i);
+        left=(int)std::floor(bounds.left());
+        top=(int)std::floor(bounds.top());
+        width=(int)std::ceil(bounds.right())-left;
+        height=(int)std::ceil(bounds.bottom())-top;
+        cells.assign(width*height, 0);
+
+        for(int i=0;i<boxes.size();i++){
+            const QRectF &box=boxes.at(i);
+            for(int j=(int)std::floor(box.top());j<(int)std::ceil(box.bottom());j++)
+                for(int k=(int)std::floor(box.left());k<(int)std::ceil(box.right());k++)
+                    cells[(j-top)*width+(k-left)]=1;
+        }
+    }
+
+    bool solid(int cx, int cy) const{
+        if(cx<left || cy<top || cx>=left+width || cy>=top+height)
+            return false;
+        return cells[(cy-top)*width+(cx-left)]!=0;
+    }
+};
+
+//Fires a burst whenever the watched signal changes
+struct ParticleEmitter{
+    bool* state;
+    bool last;
+    QRectF box;
+    ParticleKind kind;
+};
+
+struct ParticleSystem{
+    ParticlePool pool;
+    ParticleGrid grid;
+    std::vector<ParticleEmitter> emitters;
+
+    QImage sprites[ParticleKindCount];
+    QImage layer;
+    unsigned int seed=0x9e3779b9;
+
+    ParticleSystem(){
+        sprites[ParticleDust]=sprite(QColor(0xb0, 0xa0, 0x80));
+        sprites[ParticleSpark]=sprite(QColor(0xff, 0xe0, 0x60));
+        sprites[ParticleDoor]=sprite(QColor(0x60, 0xd0, 0xff));
+    }
+
+    void watch(bool* state, QRectF box, ParticleKind kind){
+        ParticleEmitter emitter;
+        emitter.state=state;
+        emitter.last=*state;
+        emitter.box=box;
+        emitter.kind=kind;
+        emitters.push_back(emitter);
+    }
+
+    //Emits for every watched signal that changed; returns true if any did
+    bool poll(){
+        bool changed=false;
+        for(int i=0;i<emitters.size();i++){
+            ParticleEmitter &emitter=emitters.at(i);
+            if(*emitter.state==emitter.last)
+                continue;
+            emitter.last=*emitter.state;
+            changed=true;
+            if(emitter.kind==ParticleSpark)
+                burst(emitter.box, ParticleSpark, 200, 0.12f, -0.08f);
+            else
+                burst(emitter.box, emitter.kind, 400, 0.05f, 0.0f);
+        }
+        return changed;
+    }
+
+    //Spawns count particles inside box with random velocity up to spread
+    void burst(QRectF box, ParticleKind kind, int count, float spread, float lift){
+        for(int i=0;i<count;i++){
+            float px=box.left()+randomUnit()*box.width();
+            float py=box.top()+randomUnit()*box.height();
+            float pvx=(randomUnit()*2-1)*spread;
+            float pvy=(randomUnit()*2-1)*spread+lift;
+            if(!pool.add(px, py, pvx, pvy, 60+randomUnit()*140, kind))
+                return;
+        }
+    }
+
+    void tick(){
+        integrate();
+        pool.compact();
+    }
+
+    //Draws every particle into one layer from the shared sprites and puts
+    //the layer on screen with a single drawImage. size is in logical pixels.
+    void render(QPainter &painter, QSize size, QPointF origin, float ratioH, float ratioV){
+        if(pool.count==0)
+            return;
+        if(layer.size()!=size)
+            layer=QImage(size, QImage::Format_ARGB32_Premultiplied);
+        layer.fill(0);
+
+        int w=layer.width()-PARTICLE_SPRITE;
+        int h=layer.height()-PARTICLE_SPRITE;
+        int stride=layer.bytesPerLine()/4;
+        quint32* bits=(quint32*)layer.bits();
+
+        for(int i=0;i<pool.count;i++){
+            int sx=(int)((pool.x[i]+origin.x())*ratioH)-PARTICLE_SPRITE/2;
+            int sy=(int)((pool.y[i]+origin.y())*ratioV)-PARTICLE_SPRITE/2;
+            if(sx<0 || sy<0 || sx>w || sy>h)
+                continue;
+
+            unsigned alpha=pool.life[i]>=32 ? 256 : (unsigned)(pool.life[i]*8);
+            const QImage &spr=sprites[pool.kind[i]];
+            for(int j=0;j<PARTICLE_SPRITE;j++){
+                const quint32* src=(const quint32*)spr.constScanLine(j);
+                quint32* dst=bits+(sy+j)*stride+sx;
+                for(int k=0;k<PARTICLE_SPRITE;k++)
+                    dst[k]=over(fade(src[k], alpha), dst[k]);
+            }
+        }
+
+        painter.drawImage(0, 0, layer);
+    }
+
+private:
+
+    float randomUnit(){
+        seed^=seed<<13;
+        seed^=seed>>17;
+        seed^=seed<<5;
+        return (seed>>8)*(1.0f/16777216.0f);
+    }
+
+    static QImage sprite(QColor color){
+        QImage image(PARTICLE_SPRITE, PARTICLE_SPRITE, QImage::Format_ARGB32_Premultiplied);
+        for(int j=0;j<PARTICLE_SPRITE;j++)
+            for(int i=0;i<PARTICLE_SPRITE;i++){
+                bool edge=i==0 || j==0 || i==PARTICLE_SPRITE-1 || j==PARTICLE_SPRITE-1;
+                image.setPixel(i, j, qPremultiply(qRgba(color.red(), color.green(), color.blue(), edge ? 0x50 : 0xff)));
+            }
+        return image;
+    }
+
+    //Premultiplied pixel times alpha in 0..256
+    static quint32 fade(quint32 p, unsigned alpha){
+        quint32 rb=((p&0x00ff00ff)*alpha>>8)&0x00ff00ff;
+        quint32 ag=((p>>8)&0x00ff00ff)*alpha&0xff00ff00;
+        return rb|ag;
+    }
+
+    static quint32 over(quint32 src, quint32 dst){
+        return src+fade(dst, 256-(src>>24));
+    }
+
+    void integrate(){
+        int count=pool.count;
+        float* x=pool.x;
+        float* y=pool.y;
+        float* vx=pool.vx;
+        float* vy=pool.vy;
+        float* life=pool.life;
+
+#ifdef PARTICLES_SSE2
+        //Four particles at a time; the tail lanes past count are scratch
+        const __m128 gravity=_mm_set1_ps(PARTICLE_GRAVITY);
+        const __m128 bounce=_mm_set1_ps(-PARTICLE_BOUNCE);
+        const __m128 friction=_mm_set1_ps(0.8f);
+        const __m128 one=_mm_set1_ps(1.0f);
+        alignas(16) int cx[4], cy[4], nx[4], ny[4];
+        alignas(16) int hitX[4], hitY[4];
+
+        for(int i=0;i<count;i+=4){
+            __m128 px=_mm_load_ps(x+i);
+            __m128 py=_mm_load_ps(y+i);
+            __m128 pvx=_mm_load_ps(vx+i);
+            __m128 pvy=_mm_add_ps(_mm_load_ps(vy+i), gravity);
+            __m128 qx=_mm_add_ps(px, pvx);
+            __m128 qy=_mm_add_ps(py, pvy);
+
+            _mm_store_si128((__m128i*)cx, cell(px));
+            _mm_store_si128((__m128i*)cy, cell(py));
+            _mm_store_si128((__m128i*)nx, cell(qx));
+            _mm_store_si128((__m128i*)ny, cell(qy));
+            for(int k=0;k<4;k++){
+                hitX[k]=grid.solid(nx[k], cy[k]) ? -1 : 0;
+                hitY[k]=grid.solid(cx[k], ny[k]) ? -1 : 0;
+            }
+            __m128 mx=_mm_castsi128_ps(_mm_load_si128((const __m128i*)hitX));
+            __m128 my=_mm_castsi128_ps(_mm_load_si128((const __m128i*)hitY));
+
+            _mm_store_ps(x+i, select(mx, px, qx));
+            _mm_store_ps(y+i, select(my, py, qy));
+            _mm_store_ps(vx+i, select(mx, _mm_mul_ps(pvx, bounce), select(my, _mm_mul_ps(pvx, friction), pvx)));
+            _mm_store_ps(vy+i, select(my, _mm_mul_ps(pvy, bounce), pvy));
+            _mm_store_ps(life+i, _mm_sub_ps(_mm_load_ps(life+i), one));
+        }
+#else
+        for(int i=0;i<count;i++){
+            vy[i]+=PARTICLE_GRAVITY;
+            float qx=x[i]+vx[i];
+            float qy=y[i]+vy[i];
+            int cx=(int)std::floor(x[i]);
+            int cy=(int)std::floor(y[i]);
+            bool hitX=grid.solid((int)std::floor(qx), cy);
+            bool hitY=grid.solid(cx, (int)std::floor(qy));
+
+            if(hitX)
+                vx[i]*=-PARTICLE_BOUNCE;
+            else
+                x[i]=qx;
+            if(hitY){
+                vy[i]*=-PARTICLE_BOUNCE;
+                if(!hitX)
+                    vx[i]*=0.8f;
+            }
+            else
+                y[i]=qy;
+            life[i]-=1;
+        }
+#endif
+    }
+
+#ifdef PARTICLES_SSE2
+    static __m128i cell(__m128 v){
+        __m128i t=_mm_cvttps_epi32(v);
+        //Truncation rounds negatives up; the compare mask is -1 there
+        return _mm_add_epi32(t, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(t), v)));
+    }
+
+    static __m128 select(__m128 mask, __m128 a, __m128 b){
+        return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    }
+#endif
+};
+
+#endif // PARTICLES_H